@@ -0,0 +1,777 @@
+#!/usr/bin/env node
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2014, Joyent, Inc.
+ */
+
+/*
+ * Conversion benchmarks. These stages are measured, each case in a child
+ * process of its own so CPU time and peak RSS are not shared:
+ *
+ *   native    the Gzip/Gunzip/Bzip/Bunzip processors, fed one grain per
+ *             write, so zlib/bzip2 dominate
+ *   boundary  JS <-> native round trips that do next to no compression work:
+ *             empty writeInto() calls and 512-byte writes, one at a time and
+ *             pipelined, with and without coalescing
+ *   e2e       a synthetic streamOptimized VMDK (see genvmdk.js) converted to
+ *             a raw image the way convertvm fills a zvol
+ *   decode    the same VMDK streamed with 1, 8 and 16 decode threads and the
+ *             output discarded, for the scaling of GrainDecoder
+ *   read      the same VMDK read start to finish through the stream and
+ *             through sequential readAt() calls
+ *
+ * Results go to stdout as one JSON document; progress goes to stderr.
+ *
+ *   node bench/bench.js [options] > results.json
+ */
+
+var async = require('async');
+var crypto = require('crypto');
+var fs = require('fs');
+var optparse = require('optparse');
+var os = require('os');
+var path = require('path');
+var spawn = require('child_process').spawn;
+var Buffer = require('buffer').Buffer;
+var VMDK = require('vmdk');
+var compress = require('vmdk/node_modules/compress');
+var genvmdk = require('./genvmdk');
+
+var FORMAT_VERSION = 1;
+var MB = 1024 * 1024;
+
+// Children are told what to run through this environment variable.
+var JOB_ENV = 'CONVERTVM_BENCH_JOB';
+
+var RSS_SAMPLE_MS = 10;
+
+var CODECS = {
+    gzip: function () { return new compress.Gzip(6, true); },
+    gunzip: function () { return new compress.Gunzip(true); },
+    bzip: function () { return new compress.Bzip(9, 0, true, true); },
+    bunzip: function () { return new compress.Bunzip(false, true); }
+};
+
+// decodeThreads settings of the decode stage; 1 is the single-threaded path.
+var DECODE_THREADS = [ 1, 8, 16 ];
+
+// Stages that run on the generated VMDK.
+var IMAGE_STAGES = [ 'e2e', 'decode', 'read' ];
+
+// Size of each readAt() call of the read stage.
+var READ_BYTES = 4 * MB;
+
+// Decoders are timed on the output of their encoder.
+var ENCODER = {
+    gunzip: 'gzip',
+    bunzip: 'bzip'
+};
+
+function now() {
+    return compress.monotonicTime();
+}
+
+/*
+ * Summary of a list of latencies in milliseconds.
+ */
+function distribution(samples) {
+    var sorted = samples.slice().sort(function (a, b) { return a - b; });
+    var sum = 0;
+    sorted.forEach(function (s) { sum += s; });
+
+    function at(p) {
+        if (sorted.length === 0) {
+            return 0;
+        }
+        return sorted[Math.min(sorted.length - 1,
+            Math.floor(p * sorted.length))];
+    }
+
+    return {
+        count: sorted.length,
+        mean: sorted.length ? sum / sorted.length : 0,
+        p50: at(0.5),
+        p90: at(0.9),
+        p99: at(0.99),
+        max: sorted.length ? sorted[sorted.length - 1] : 0
+    };
+}
+
+/*
+ * Wall time, CPU time and peak RSS of the current process over one case.
+ */
+function Meter() {
+    var self = this;
+
+    self.peakRss = process.memoryUsage().rss;
+    self.timer = setInterval(function () {
+        self.sample();
+    }, RSS_SAMPLE_MS);
+    self.usage = compress.resourceUsage();
+    compress.resetStats();
+    self.start = now();
+}
+
+Meter.prototype.sample = function () {
+    this.peakRss = Math.max(this.peakRss, process.memoryUsage().rss);
+};
+
+Meter.prototype.stop = function () {
+    var seconds = (now() - this.start) / 1000;
+    var usage = compress.resourceUsage();
+
+    clearInterval(this.timer);
+    this.sample();
+
+    var user = usage.user - this.usage.user;
+    var system = usage.system - this.usage.system;
+    return {
+        seconds: seconds,
+        cpu: {
+            user: user,
+            system: system,
+            utilization: seconds > 0 ? (user + system) / seconds : 0
+        },
+        peakRss: Math.max(this.peakRss, usage.maxRss),
+        native: compress.stats()
+    };
+};
+
+function result(stage, name, meter, fields) {
+    var r = { stage: stage, name: name };
+    Object.keys(fields).forEach(function (key) {
+        r[key] = fields[key];
+    });
+    var m = meter.stop();
+    Object.keys(m).forEach(function (key) {
+        r[key] = m[key];
+    });
+    return r;
+}
+
+/*
+ * Feed `chunks` to a fresh codec one write at a time, then close it.
+ * callback(error, output chunks, per-write latencies).
+ */
+function runCodec(codec, chunks, callback) {
+    var coder = CODECS[codec]();
+    var output = [];
+    var latencies = [];
+    var i = 0;
+
+    function collect(data) {
+        if (data && data.length) {
+            output.push(data);
+        }
+    }
+
+    async.whilst(
+        function () { return i < chunks.length; },
+        function (w$callback) {
+            var start = now();
+            coder.write(chunks[i++], function (error, data) {
+                latencies.push(now() - start);
+                collect(data);
+                w$callback(error);
+            });
+        },
+        function (error) {
+            if (error) {
+                return callback(error);
+            }
+            return coder.close(function (close$error, data) {
+                collect(data);
+                callback(close$error, output, latencies);
+            });
+        });
+}
+
+function sumLength(chunks) {
+    var n = 0;
+    chunks.forEach(function (c) { n += c.length; });
+    return n;
+}
+
+/*
+ * Synthetic disk data with the configured compressibility; no sparse grains
+ * here, those never reach the codecs.
+ */
+function corpus(config) {
+    var o = genvmdk.normalize({
+        grainSectors: config.grainSectors,
+        compressibility: config.compressibility,
+        seed: config.seed
+    });
+    var count = Math.max(1, Math.floor(config.nativeSize / o.grainBytes));
+    var chunks = [];
+    for (var g = 0; g < count; g++) {
+        chunks.push(genvmdk.fillGrain(o, g, new Buffer(o.grainBytes)));
+    }
+    return chunks;
+}
+
+var STAGES = {};
+
+STAGES.native = function (job, callback) {
+    var config = job.config;
+    var input = corpus(config);
+    var grainBytes = input[0].length;
+
+    function timed(chunks) {
+        var meter = new Meter();
+        runCodec(job.name, chunks, function (error, output, latencies) {
+            if (error) {
+                return callback(error);
+            }
+            var bytesIn = sumLength(chunks);
+            var r = result('native', job.name, meter, {
+                bytesIn: bytesIn,
+                bytesOut: sumLength(output),
+                writes: chunks.length,
+                writeSize: grainBytes,
+                latencyMs: distribution(latencies)
+            });
+            r.throughputMBps = bytesIn / MB / r.seconds;
+            r.grainUs = r.seconds * 1e6 / input.length;
+            return callback(null, r);
+        });
+    }
+
+    if (!ENCODER[job.name]) {
+        return timed(input);
+    }
+
+    // Untimed: produce the compressed stream, then cut it into grain-sized
+    // writes for the decoder.
+    return runCodec(ENCODER[job.name], input, function (error, output) {
+        if (error) {
+            return callback(error);
+        }
+        var whole = concat(output);
+        var chunks = [];
+        for (var off = 0; off < whole.length; off += grainBytes) {
+            chunks.push(whole.slice(off, Math.min(whole.length,
+                off + grainBytes)));
+        }
+        return timed(chunks);
+    });
+};
+
+function concat(list) {
+    var buffer = new Buffer(sumLength(list));
+    var off = 0;
+    list.forEach(function (b) {
+        b.copy(buffer, off);
+        off += b.length;
+    });
+    return buffer;
+}
+
+STAGES.boundary = function (job, callback) {
+    var calls = job.config.boundaryCalls;
+    var coder = new compress.Gzip(1, true);
+    var latencies = [];
+    var meter;
+    var done = 0;
+
+    function finish(error, fields) {
+        if (error) {
+            return callback(error);
+        }
+        var r = result('boundary', job.name, meter, fields);
+        r.callsPerSecond = calls / r.seconds;
+        r.callUs = r.seconds * 1e6 / calls;
+        return coder.close(function () {
+            callback(null, r);
+        });
+    }
+
+    if (job.name === 'roundtrip-0') {
+        // Nothing to compress: what is left is the cost of the trip.
+        var empty = new Buffer(0);
+        var out = new Buffer(64);
+        meter = new Meter();
+        return async.whilst(
+            function () { return done < calls; },
+            function (w$callback) {
+                var start = now();
+                coder.writeInto(empty, out, function (error) {
+                    latencies.push(now() - start);
+                    done++;
+                    w$callback(error);
+                });
+            },
+            function (error) {
+                finish(error, { calls: calls, writeSize: 0,
+                    latencyMs: distribution(latencies) });
+            });
+    }
+
+    var sector = new Buffer(512);
+    sector.fill(0);
+
+    if (job.name === 'roundtrip-512') {
+        meter = new Meter();
+        return async.whilst(
+            function () { return done < calls; },
+            function (w$callback) {
+                var start = now();
+                coder.write(sector, function (error) {
+                    latencies.push(now() - start);
+                    done++;
+                    w$callback(error);
+                });
+            },
+            function (error) {
+                finish(error, { calls: calls, writeSize: 512,
+                    latencyMs: distribution(latencies) });
+            });
+    }
+
+    // pipelined-512: everything is queued up front, and coalesced in the
+    // -coalesced variant.
+    if (job.name === 'pipelined-512-coalesced') {
+        coder.coalesceWrites();
+    }
+    var failed = null;
+    meter = new Meter();
+    for (var i = 0; i < calls; i++) {
+        (function (start) {
+            coder.write(sector, function (error) {
+                latencies.push(now() - start);
+                failed = failed || error;
+                if (++done === calls) {
+                    finish(failed, { calls: calls, writeSize: 512,
+                        latencyMs: distribution(latencies) });
+                }
+            });
+        })(now());
+    }
+    return undefined;
+};
+
+STAGES.e2e = function (job, callback) {
+    var image = job.image;
+    var rawPath = image.path + '.raw';
+    var v = new VMDK({ filename: image.path });
+    var meter = new Meter();
+
+    v.open(function (open$error) {
+        if (open$error) {
+            return callback(open$error);
+        }
+
+        var out = new compress.SparseWriteStream(rawPath,
+            { blockSize: v.header.grainSize[0] * 512 });
+        var stream = v.stream({ holes: true });
+        var failed = false;
+
+        function fail(error) {
+            if (failed) {
+                return;
+            }
+            failed = true;
+            out.destroy();
+            callback(error);
+        }
+
+        stream.on('error', fail);
+        out.on('error', fail);
+        out.on('close', function () {
+            if (failed) {
+                return;
+            }
+            var r = result('e2e', job.name, meter, {
+                bytesIn: image.fileSize,
+                bytesOut: out.bytesWritten + out.bytesSkipped,
+                bytesWritten: out.bytesWritten,
+                bytesSkipped: out.bytesSkipped,
+                grains: image.grains,
+                allocatedGrains: image.allocatedGrains
+            });
+            r.throughputMBps = image.capacity / MB / r.seconds;
+            r.inputMBps = image.fileSize / MB / r.seconds;
+            r.grainUs = r.seconds * 1e6 / image.grains;
+
+            v.close(function () {
+                verify(rawPath, image, function (verify$error, ok) {
+                    r.verified = !verify$error && ok;
+                    if (!job.keep) {
+                        fs.unlink(rawPath, function () {});
+                    }
+                    callback(null, r);
+                });
+            });
+        });
+
+        stream.pipe(out);
+        stream.start();
+    });
+};
+
+/*
+ * Read a whole image with `read(v, onData, callback)`. The output is only
+ * counted: hashing or writing it would cap the throughput being measured.
+ * Opening the image is part of the timed work.
+ */
+function timeRead(job, options, read, callback) {
+    var image = job.image;
+    var v = new VMDK(options);
+    var meter = new Meter();
+    var bytes = 0;
+
+    v.open(function (open$error) {
+        if (open$error) {
+            return callback(open$error);
+        }
+        return read(v, function (data) {
+            bytes += data.length;
+        }, function (error) {
+            if (error) {
+                v.close(function () {});
+                return callback(error);
+            }
+            var r = result(job.stage, job.name, meter, {
+                bytesIn: image.fileSize,
+                bytesOut: bytes,
+                grains: image.grains,
+                allocatedGrains: image.allocatedGrains
+            });
+            r.complete = bytes === image.capacity;
+            r.throughputMBps = image.capacity / MB / r.seconds;
+            r.grainUs = r.seconds * 1e6 / image.grains;
+            return v.close(function () {
+                callback(null, r);
+            });
+        });
+    });
+}
+
+function readStream(v, onData, callback) {
+    var stream = v.stream();
+    stream.on('data', onData);
+    stream.on('error', callback);
+    stream.on('end', function () {
+        callback();
+    });
+    stream.start();
+}
+
+STAGES.decode = function (job, callback) {
+    timeRead(job, {
+        filename: job.image.path,
+        decodeThreads: Number(job.name.replace('threads-', ''))
+    }, readStream, callback);
+};
+
+// One readAt() after the other, as a sequential consumer would do.
+function readSequential(v, onData, callback) {
+    var position = 0;
+
+    function next() {
+        v.readAt(position, READ_BYTES, function (error, buffer) {
+            if (error) {
+                return callback(error);
+            }
+            if (buffer.length === 0) {
+                return callback();
+            }
+            onData(buffer);
+            position += buffer.length;
+            return next();
+        });
+    }
+
+    next();
+}
+
+STAGES.read = function (job, callback) {
+    timeRead(job, { filename: job.image.path },
+        job.name === 'readAt' ? readSequential : readStream, callback);
+};
+
+/*
+ * Ratios between cases, so the report answers its questions directly.
+ */
+function summarize(results) {
+    function find(stage, name) {
+        for (var i = 0; i < results.length; i++) {
+            if (results[i].stage === stage && results[i].name === name) {
+                return results[i];
+            }
+        }
+        return null;
+    }
+
+    var summary = {};
+
+    // Speedup of each decodeThreads setting over the single-threaded path.
+    var single = find('decode', 'threads-1');
+    if (single) {
+        summary.decodeSpeedup = {};
+        DECODE_THREADS.forEach(function (threads) {
+            var r = find('decode', 'threads-' + threads);
+            if (r) {
+                summary.decodeSpeedup[threads] =
+                    r.throughputMBps / single.throughputMBps;
+            }
+        });
+    }
+
+    // Above 1 when sequential readAt() beats the stream.
+    var stream = find('read', 'stream');
+    var readAt = find('read', 'readAt');
+    if (stream && readAt) {
+        summary.readAtVsStream = readAt.throughputMBps / stream.throughputMBps;
+    }
+
+    return summary;
+}
+
+function verify(rawPath, image, callback) {
+    var hash = crypto.createHash('sha1');
+    var input = fs.createReadStream(rawPath);
+    input.on('data', function (data) { hash.update(data); });
+    input.on('error', callback);
+    input.on('end', function () {
+        callback(null, hash.digest('hex') === image.sha1);
+    });
+}
+
+/*
+ * Child side: run one case, print its result.
+ */
+function runJob(job) {
+    STAGES[job.stage](job, function (error, r) {
+        if (error) {
+            console.error('bench: %s/%s failed: %s', job.stage, job.name,
+                error.message);
+            process.exit(1);
+        }
+        // Let the loop drain rather than exit: stdout may be a pipe.
+        process.stdout.write(JSON.stringify(r) + '\n');
+    });
+}
+
+/*
+ * Parent side: run one case in a child process. callback(error, result).
+ */
+function spawnJob(job, verbose, callback) {
+    var env = {};
+    Object.keys(process.env).forEach(function (key) {
+        env[key] = process.env[key];
+    });
+    env[JOB_ENV] = JSON.stringify(job);
+
+    var child = spawn(process.execPath, [ __filename ], { env: env });
+    var stdout = '';
+    var stderr = '';
+    var pending = 3;
+    var code;
+
+    function done() {
+        if (--pending > 0) {
+            return undefined;
+        }
+        if (code !== 0) {
+            return callback(new Error(job.stage + '/' + job.name +
+                ' exited with ' + code + ': ' + stderr.trim()));
+        }
+        try {
+            return callback(null, JSON.parse(stdout));
+        } catch (e) {
+            return callback(e);
+        }
+    }
+
+    child.stdout.setEncoding('utf8');
+    child.stderr.setEncoding('utf8');
+    child.stdout.on('data', function (data) { stdout += data; });
+    child.stderr.on('data', function (data) {
+        // vmdk.js is chatty; only keep the tail for error reports.
+        if (verbose) {
+            process.stderr.write(data);
+        }
+        stderr = (stderr + data).slice(-4096);
+    });
+    child.stdout.on('end', done);
+    child.stderr.on('end', done);
+    child.on('exit', function (status) {
+        code = status;
+        done();
+    });
+}
+
+function parseOptions() {
+    var config = {
+        size: 256 * MB,
+        grainSectors: 128,
+        sparsity: 0.5,
+        compressibility: 0.5,
+        seed: 1,
+        nativeSize: 64 * MB,
+        boundaryCalls: 20000,
+        stages: [ 'native', 'boundary', 'e2e', 'decode', 'read' ],
+        dir: process.env.TMPDIR || '/var/tmp',
+        keep: false,
+        verbose: false
+    };
+
+    var switches = [
+        ['-h', '--help', 'This help message'],
+        ['-s', '--size NUMBER', 'e2e disk size in MiB (default 256)'],
+        ['-g', '--grain-sectors NUMBER', 'Sectors per grain (default 128)'],
+        ['-p', '--sparsity NUMBER',
+            'Fraction of unallocated grains (default 0.5)'],
+        ['-c', '--compressibility NUMBER',
+            'Fraction of repetitive sectors in a grain (default 0.5)'],
+        ['-r', '--seed NUMBER', 'Random seed (default 1)'],
+        ['-n', '--native-size NUMBER',
+            'MiB fed to each codec in the native stage (default 64)'],
+        ['-b', '--boundary-calls NUMBER',
+            'Calls per boundary case (default 20000)'],
+        ['-S', '--stages VALUE',
+            'Comma-separated stages to run ' +
+            '(default native,boundary,e2e,decode,read)'],
+        ['-d', '--dir VALUE', 'Scratch directory (default $TMPDIR)'],
+        ['-k', '--keep', 'Keep the generated VMDK and raw image'],
+        ['-v', '--verbose', 'Pass through what the cases log']
+    ];
+
+    var parser = new optparse.OptionParser(switches);
+    parser.banner = 'Usage: ' + process.argv[1] + ' [options]';
+
+    parser.on('help', function () {
+        console.log(parser.toString());
+        process.exit(0);
+    });
+    parser.on('size', function (name, value) {
+        config.size = Number(value) * MB;
+    });
+    parser.on('grain-sectors', function (name, value) {
+        config.grainSectors = Number(value);
+    });
+    parser.on('sparsity', function (name, value) {
+        config.sparsity = Number(value);
+    });
+    parser.on('compressibility', function (name, value) {
+        config.compressibility = Number(value);
+    });
+    parser.on('seed', function (name, value) {
+        config.seed = Number(value);
+    });
+    parser.on('native-size', function (name, value) {
+        config.nativeSize = Number(value) * MB;
+    });
+    parser.on('boundary-calls', function (name, value) {
+        config.boundaryCalls = Number(value);
+    });
+    parser.on('stages', function (name, value) {
+        config.stages = value.split(',');
+    });
+    parser.on('dir', function (name, value) {
+        config.dir = value;
+    });
+    parser.on('keep', function () {
+        config.keep = true;
+    });
+    parser.on('verbose', function () {
+        config.verbose = true;
+    });
+    parser.parse(process.argv);
+
+    config.stages.forEach(function (stage) {
+        if (!STAGES[stage]) {
+            console.error('bench: unknown stage "%s"', stage);
+            process.exit(1);
+        }
+    });
+    return config;
+}
+
+function main() {
+    var config = parseOptions();
+    var image;
+    var jobs = [];
+
+    config.stages.forEach(function (stage) {
+        var names = {
+            native: Object.keys(CODECS),
+            boundary: [ 'roundtrip-0', 'roundtrip-512', 'pipelined-512',
+                'pipelined-512-coalesced' ],
+            e2e: [ 'vmdk-to-raw' ],
+            decode: DECODE_THREADS.map(function (threads) {
+                return 'threads-' + threads;
+            }),
+            read: [ 'stream', 'readAt' ]
+        }[stage];
+        names.forEach(function (name) {
+            jobs.push({ stage: stage, name: name, config: config,
+                keep: config.keep });
+        });
+    });
+
+    var report = {
+        version: FORMAT_VERSION,
+        date: new Date().toISOString(),
+        node: process.version,
+        platform: process.platform,
+        arch: process.arch,
+        cpus: os.cpus().length,
+        config: config,
+        results: []
+    };
+
+    async.series([
+        function (s$callback) {
+            var needImage = config.stages.some(function (stage) {
+                return IMAGE_STAGES.indexOf(stage) !== -1;
+            });
+            if (!needImage) {
+                return s$callback();
+            }
+            var vmdkPath = path.join(config.dir,
+                'convertvm-bench-' + process.pid + '.vmdk');
+            console.error('bench: generating %s', vmdkPath);
+            return genvmdk.generate(vmdkPath, config, function (error, info) {
+                image = info;
+                report.image = info;
+                s$callback(error);
+            });
+        },
+        function (s$callback) {
+            async.forEachSeries(jobs, function (job, fe$callback) {
+                console.error('bench: %s/%s', job.stage, job.name);
+                job.image = image;
+                spawnJob(job, config.verbose, function (error, r) {
+                    if (!error) {
+                        report.results.push(r);
+                    }
+                    fe$callback(error);
+                });
+            }, s$callback);
+        }
+    ],
+    function (error) {
+        if (image && !config.keep) {
+            fs.unlink(image.path, function () {});
+        }
+        if (error) {
+            console.error('bench: ' + error.message);
+            process.exit(1);
+        }
+        report.summary = summarize(report.results);
+        console.log(JSON.stringify(report, null, 2));
+    });
+}
+
+if (process.env[JOB_ENV]) {
+    runJob(JSON.parse(process.env[JOB_ENV]));
+} else {
+    main();
+}
@@ -0,0 +1,414 @@
+#!/usr/bin/env node
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2014, Joyent, Inc.
+ */
+
+/*
+ * Builds synthetic streamOptimized VMDKs for benchmarks, with the layout
+ * vmdk.js parses: header (gdOffset deferred to the footer), descriptor,
+ * compressed grains behind grain markers, a grain table after every 512
+ * grains, then the grain directory, footer and end-of-stream markers.
+ *
+ * Contents are reproducible for a given seed:
+ *   sparsity        fraction of grains left unallocated (read as zeroes)
+ *   compressibility fraction of sectors in an allocated grain filled with
+ *                   repetitive text rather than random bytes
+ *
+ * Capacity is rounded up to whole grain tables (32 MiB with 64 KiB grains),
+ * since VMDKStream emits every grain of each table it parses.
+ *
+ *   node bench/genvmdk.js [options] <out.vmdk>
+ */
+
+var async = require('async');
+var crypto = require('crypto');
+var fs = require('fs');
+var optparse = require('optparse');
+var path = require('path');
+var zlib = require('zlib');
+var Buffer = require('buffer').Buffer;
+
+var SECTOR_SIZE = 512;
+var GTES_PER_GT = 512;
+var GT_SECTORS = GTES_PER_GT * 4 / SECTOR_SIZE;
+var OVERHEAD_SECTORS = 128;
+var DESCRIPTOR_OFFSET = 1;
+var DESCRIPTOR_SECTORS = 1;
+
+var FLAG_NEWLINE_TEST = 0x1;
+var FLAG_COMPRESSED = 0x10000;
+var FLAG_MARKERS = 0x20000;
+var COMPRESSION_DEFLATE = 1;
+
+var MARKER_EOS = 0;
+var MARKER_GT = 1;
+var MARKER_GD = 2;
+var MARKER_FOOTER = 3;
+
+// Grains deflated at once while building a table.
+var DEFLATE_CONCURRENCY = 8;
+
+var DEFAULTS = {
+    size: 256 * 1024 * 1024,
+    grainSectors: 128,
+    sparsity: 0.5,
+    compressibility: 0.5,
+    seed: 1
+};
+
+var TEXT = new Buffer(
+    'Lorem ipsum dolor sit amet, consectetur adipisicing elit, sed do ' +
+    'eiusmod tempor incididunt ut labore et dolore magna aliqua. Ut enim ' +
+    'ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut ' +
+    'aliquip ex ea commodo consequat. Duis aute irure dolor in ' +
+    'reprehenderit in voluptate velit esse cillum dolore eu fugiat nulla ' +
+    'pariatur. Excepteur sint occaecat cupidatat non proident, sunt in ' +
+    'culpa qui officia deserunt mollit anim id est laborum.\n');
+
+/*
+ * Exact 32-bit multiply; Math.imul is not available everywhere.
+ */
+function mul32(a, b) {
+    return ((a & 0xffff) * b + ((((a >>> 16) * b) & 0xffff) << 16)) >>> 0;
+}
+
+/*
+ * murmur3 finalizer, so neighbouring grains get unrelated seeds.
+ */
+function mix32(h) {
+    h = (h ^ (h >>> 16)) >>> 0;
+    h = mul32(h, 0x85ebca6b);
+    h = (h ^ (h >>> 13)) >>> 0;
+    h = mul32(h, 0xc2b2ae35);
+    return (h ^ (h >>> 16)) >>> 0;
+}
+
+/*
+ * xorshift32; seeded per grain so any grain can be rebuilt on its own.
+ */
+function Random(seed, grain) {
+    this.x = mix32((grain + mul32(seed, 0x9e3779b9)) >>> 0) || 1;
+}
+
+Random.prototype.next = function () {
+    var x = this.x;
+    x = (x ^ (x << 13)) >>> 0;
+    x = (x ^ (x >>> 17)) >>> 0;
+    x = (x ^ (x << 5)) >>> 0;
+    this.x = x;
+    return x;
+};
+
+Random.prototype.uniform = function () {
+    return this.next() / 4294967296;
+};
+
+function normalize(options) {
+    var o = {};
+    Object.keys(DEFAULTS).forEach(function (key) {
+        o[key] = options && options[key] !== undefined ?
+            options[key] : DEFAULTS[key];
+    });
+    o.grainBytes = o.grainSectors * SECTOR_SIZE;
+    var tableBytes = o.grainBytes * GTES_PER_GT;
+    o.tables = Math.max(1, Math.ceil(o.size / tableBytes));
+    o.grains = o.tables * GTES_PER_GT;
+    o.capacity = o.grains * o.grainBytes;
+    return o;
+}
+
+/*
+ * Whether `grain` holds data.
+ */
+function isAllocated(o, grain) {
+    return new Random(o.seed, grain).uniform() >= o.sparsity;
+}
+
+/*
+ * Fill `buffer` (one grain) with the contents of `grain`.
+ */
+function fillGrain(o, grain, buffer) {
+    var random = new Random(o.seed, grain);
+    random.next();
+
+    for (var off = 0; off < buffer.length; off += SECTOR_SIZE) {
+        var end = Math.min(off + SECTOR_SIZE, buffer.length);
+        if (random.uniform() < o.compressibility) {
+            var start = random.next() % TEXT.length;
+            for (var i = off; i < end; i++) {
+                buffer[i] = TEXT[(start + i) % TEXT.length];
+            }
+        } else {
+            for (var j = off; j + 4 <= end; j += 4) {
+                buffer.writeUInt32LE(random.next(), j);
+            }
+        }
+    }
+    return buffer;
+}
+
+function writeSectorType(buffer, value, offset) {
+    buffer.writeUInt32LE(value % 4294967296, offset);
+    buffer.writeUInt32LE(Math.floor(value / 4294967296), offset + 4);
+}
+
+/*
+ * SparseExtentHeader; gdSector undefined means GD_AT_END.
+ */
+function header(o, gdSector) {
+    var buffer = new Buffer(SECTOR_SIZE);
+    buffer.fill(0);
+    buffer.write('KDMV', 0, 'binary');
+    buffer.writeUInt32LE(3, 4);
+    buffer.writeUInt32LE(FLAG_NEWLINE_TEST | FLAG_COMPRESSED | FLAG_MARKERS, 8);
+    writeSectorType(buffer, o.capacity / SECTOR_SIZE, 12);
+    writeSectorType(buffer, o.grainSectors, 20);
+    writeSectorType(buffer, DESCRIPTOR_OFFSET, 28);
+    writeSectorType(buffer, DESCRIPTOR_SECTORS, 36);
+    buffer.writeUInt32LE(GTES_PER_GT, 44);
+    if (gdSector === undefined) {
+        buffer.writeUInt32LE(0xffffffff, 56);
+        buffer.writeUInt32LE(0xffffffff, 60);
+    } else {
+        writeSectorType(buffer, gdSector, 56);
+    }
+    writeSectorType(buffer, OVERHEAD_SECTORS, 64);
+    buffer.write('\n \r\n', 73, 'binary');
+    buffer.writeUInt16LE(COMPRESSION_DEFLATE, 77);
+    return buffer;
+}
+
+function descriptor(o, filename) {
+    var text = [
+        '# Disk DescriptorFile',
+        'version=1',
+        'CID=fffffffe',
+        'parentCID=ffffffff',
+        'createType="streamOptimized"',
+        '',
+        '# Extent description',
+        'RW ' + o.capacity / SECTOR_SIZE + ' SPARSE "' + filename + '"',
+        '',
+        '# The Disk Data Base',
+        '#DDB',
+        '',
+        'ddb.virtualHWVersion = "4"',
+        'ddb.adapterType = "lsilogic"',
+        ''
+    ].join('\n');
+
+    var buffer = new Buffer(DESCRIPTOR_SECTORS * SECTOR_SIZE);
+    buffer.fill(0);
+    buffer.write(text, 0, 'binary');
+    return buffer;
+}
+
+function marker(val, type) {
+    var buffer = new Buffer(SECTOR_SIZE);
+    buffer.fill(0);
+    writeSectorType(buffer, val, 0);
+    buffer.writeUInt32LE(type, 12);
+    return buffer;
+}
+
+/*
+ * Grain marker and deflated data, padded to a sector.
+ */
+function grainRecord(lba, data) {
+    var length = Math.ceil((12 + data.length) / SECTOR_SIZE) * SECTOR_SIZE;
+    var buffer = new Buffer(length);
+    writeSectorType(buffer, lba, 0);
+    buffer.writeUInt32LE(data.length, 8);
+    data.copy(buffer, 12);
+    buffer.fill(0, 12 + data.length);
+    return buffer;
+}
+
+/*
+ * generate(filename, options, callback)
+ *
+ * Options are those in DEFAULTS, with `size` in bytes. callback(error, info)
+ * where info describes the image, including the SHA-1 of its contents.
+ */
+function generate(filename, options, callback) {
+    var o = normalize(options);
+    var hash = crypto.createHash('sha1');
+    var zero = new Buffer(o.grainBytes);
+    var directory = new Buffer(Math.ceil(o.tables * 4 / SECTOR_SIZE) *
+        SECTOR_SIZE);
+    var sector = 0;
+    var allocated = 0;
+    var fd;
+
+    zero.fill(0);
+    directory.fill(0);
+
+    function write(buffer) {
+        var done = 0;
+        while (done < buffer.length) {
+            done += fs.writeSync(fd, buffer, done, buffer.length - done,
+                sector * SECTOR_SIZE + done);
+        }
+        sector += buffer.length / SECTOR_SIZE;
+    }
+
+    function writeTable(table, wt$callback) {
+        var first = table * GTES_PER_GT;
+        var grains = [];
+        var present = [];
+        for (var i = 0; i < GTES_PER_GT; i++) {
+            grains.push({ grain: first + i });
+            if (isAllocated(o, first + i)) {
+                present.push(grains[i]);
+            }
+        }
+
+        // Only hand async iterators that call back asynchronously.
+        async.forEachLimit(present, DEFLATE_CONCURRENCY,
+            function (g, fe$callback) {
+                g.data = fillGrain(o, g.grain, new Buffer(o.grainBytes));
+                zlib.deflate(g.data, function (error, deflated) {
+                    g.deflated = deflated;
+                    fe$callback(error);
+                });
+            },
+            function (deflate$error) {
+                if (deflate$error) {
+                    return wt$callback(deflate$error);
+                }
+
+                var entries = new Buffer(GTES_PER_GT * 4);
+                entries.fill(0);
+                grains.forEach(function (g, index) {
+                    if (!g.data) {
+                        hash.update(zero);
+                        return;
+                    }
+                    hash.update(g.data);
+                    entries.writeUInt32LE(sector, index * 4);
+                    write(grainRecord(g.grain * o.grainSectors, g.deflated));
+                    allocated++;
+                });
+
+                // vmdk.js needs a table for every run of 512 grains, empty
+                // or not, to keep its output in place.
+                write(marker(GT_SECTORS, MARKER_GT));
+                directory.writeUInt32LE(sector, table * 4);
+                write(entries);
+                wt$callback();
+            });
+    }
+
+    try {
+        fd = fs.openSync(filename, 'w');
+        write(header(o));
+        write(descriptor(o, path.basename(filename)));
+        sector = OVERHEAD_SECTORS;
+    } catch (e) {
+        return callback(e);
+    }
+
+    var tables = [];
+    for (var t = 0; t < o.tables; t++) {
+        tables.push(t);
+    }
+
+    return async.forEachSeries(tables, writeTable, function (error) {
+        var info;
+        try {
+            if (!error) {
+                write(marker(directory.length / SECTOR_SIZE, MARKER_GD));
+                var gdSector = sector;
+                write(directory);
+                write(marker(1, MARKER_FOOTER));
+                write(header(o, gdSector));
+                write(marker(0, MARKER_EOS));
+
+                info = {
+                    path: filename,
+                    capacity: o.capacity,
+                    grainSize: o.grainBytes,
+                    grains: o.grains,
+                    allocatedGrains: allocated,
+                    fileSize: sector * SECTOR_SIZE,
+                    sparsity: o.sparsity,
+                    compressibility: o.compressibility,
+                    seed: o.seed,
+                    sha1: hash.digest('hex')
+                };
+            }
+            fs.closeSync(fd);
+        } catch (e) {
+            error = error || e;
+        }
+        return callback(error, info);
+    });
+}
+
+module.exports = {
+    DEFAULTS: DEFAULTS,
+    normalize: normalize,
+    isAllocated: isAllocated,
+    fillGrain: fillGrain,
+    generate: generate
+};
+
+if (require.main === module) {
+    var switches = [
+        ['-h', '--help', 'This help message'],
+        ['-s', '--size NUMBER', 'Disk size in MiB (default 256)'],
+        ['-g', '--grain-sectors NUMBER', 'Sectors per grain (default 128)'],
+        ['-p', '--sparsity NUMBER',
+            'Fraction of unallocated grains (default 0.5)'],
+        ['-c', '--compressibility NUMBER',
+            'Fraction of repetitive sectors in a grain (default 0.5)'],
+        ['-r', '--seed NUMBER', 'Random seed (default 1)']
+    ];
+    var options = {};
+    var output;
+    var parser = new optparse.OptionParser(switches);
+    parser.banner = 'Usage: ' + process.argv[1] + ' [options] <out.vmdk>';
+
+    parser.on(2, function (value) {
+        output = value;
+    });
+    parser.on('help', function () {
+        console.log(parser.toString());
+        process.exit(0);
+    });
+    parser.on('size', function (name, value) {
+        options.size = Number(value) * 1024 * 1024;
+    });
+    parser.on('grain-sectors', function (name, value) {
+        options.grainSectors = Number(value);
+    });
+    parser.on('sparsity', function (name, value) {
+        options.sparsity = Number(value);
+    });
+    parser.on('compressibility', function (name, value) {
+        options.compressibility = Number(value);
+    });
+    parser.on('seed', function (name, value) {
+        options.seed = Number(value);
+    });
+    parser.parse(process.argv);
+
+    if (!output) {
+        console.error(parser.toString());
+        process.exit(1);
+    }
+
+    generate(output, options, function (error, info) {
+        if (error) {
+            console.error('genvmdk: ' + error.message);
+            process.exit(1);
+        }
+        console.log(JSON.stringify(info, null, 2));
+    });
+}
@@ -24,6 +24,7 @@ var rimraf = require('rimraf');
 
 var CLI = module.exports = function () {
     this.fileDigests = {};
+    this.imageDigests = {};
 };
 
 CLI.prototype.parseOptions = function () {
@@ -342,24 +343,39 @@ CLI.prototype.populateFiles = function (callback) {
                     self.files[file].href, '.zfs.bz2')
             };
 
+            /*
+             * Images converted in this run were hashed while they were
+             * compressed; only fall back to reading the file back otherwise.
+             */
+            var digest = self.imageDigests[file];
+            if (digest) {
+                record.size = digest.bytes;
+                self.fileDigests[file] = record.sha1 = digest.sha1;
+                self.manifest.files.push(record);
+                return fecallback();
+            }
+
             async.waterfall([
                 function (wf$callback) {
-                    fs.stat(self.files[file].path, function (error, stat) {
+                    fs.stat(outputFile, function (error, stat) {
+                        if (error) {
+                            return wf$callback(error);
+                        }
                         record.size = stat.size;
-                        wf$callback();
+                        return wf$callback();
                     });
                 },
                 function (wf$callback) {
                     console.log('Verifying file ' + outputFile);
                     common.sha1file(outputFile, function (error, sha) {
                         self.fileDigests[file] = record.sha1 = sha;
-                        wf$callback();
+                        wf$callback(error);
                     });
                 }
             ],
             function (error) {
                 self.manifest.files.push(record);
-                return callback(error);
+                return fecallback(error);
             });
         },
         function (error) {
@@ -367,6 +383,45 @@ CLI.prototype.populateFiles = function (callback) {
         });
 };
 
+function mb(bytes) {
+    return (bytes / (1024 * 1024)).toFixed(1) + ' MB';
+}
+
+function ms(micros) {
+    return (micros / 1000).toFixed(1) + 'ms';
+}
+
+/*
+ * Prints where the native work of each conversion stage went: throughput,
+ * time queued for a worker thread against time spent in zlib/bzip2, and time
+ * spent in the JavaScript callbacks. Times are summed over all threads, so
+ * they can exceed the wall time of the stage.
+ */
+function printStageStats(stageStats) {
+    Object.keys(stageStats).forEach(function (stage) {
+        var seconds = stageStats[stage].seconds;
+        var stats = stageStats[stage].stats;
+
+        console.log('Stage %s: %ss', stage, seconds.toFixed(2));
+        Object.keys(stats).forEach(function (kind) {
+            var s = stats[kind];
+            if (s.requests === 0) {
+                return;
+            }
+            console.log('  %s: %d requests in %d passes, %s in, %s out, ' +
+                '%s/s', kind, s.requests, s.passes, mb(s.bytesIn),
+                mb(s.bytesOut), mb(seconds > 0 ? s.bytesIn / seconds : 0));
+            console.log('    queue wait %ss (p99 %s), work %ss (p99 %s)',
+                (s.queueWait.totalUs / 1e6).toFixed(2), ms(s.queueWait.p99Us),
+                (s.work.totalUs / 1e6).toFixed(2), ms(s.work.p99Us));
+            console.log('    latency p50 %s p99 %s, callbacks %ss, ' +
+                'reallocs %d (peak %s)', ms(s.latency.p50Us),
+                ms(s.latency.p99Us), (s.callback.totalUs / 1e6).toFixed(2),
+                s.reallocs, mb(s.peakBlobCapacity));
+        });
+    });
+}
+
 CLI.prototype.createDiskImages = function (callback) {
     var self = this;
     self.disks = self.ovf.disks;
@@ -384,8 +439,12 @@ CLI.prototype.createDiskImages = function (callback) {
                 format: disk.format
             };
 
-            diskImage.convertToZfsStream(opts, function (error) {
+            diskImage.convertToZfsStream(opts, function (error, digest) {
                 console.log('Done converting ' + disk);
+                printStageStats(diskImage.stageStats);
+                if (digest) {
+                    self.imageDigests[disk.file.id] = digest;
+                }
                 fe$callback();
             });
         },
@@ -9,11 +9,11 @@
  */
 
 var execFile = require('child_process').execFile;
-var exec = require('child_process').exec;
 var spawn = require('child_process').spawn;
 var zfs = require('zfs').zfs;
 var async = require('async');
 var VMDK = require('vmdk');
+var compress = require('vmdk/node_modules/compress');
 var fs = require('fs');
 
 /*
@@ -62,15 +62,16 @@ DiskImage.prototype.convertToZfsStream = function (opts, callback) {
     this.zvolDskPath = '/dev/zvol/dsk/' + this.zvolName;
     this.inputFile = opts.inputFile;
     this.outputFile = opts.outputFile;
+    this.stageStats = {};
 
     async.waterfall([
         self.createZvol.bind(self),
-        self.vmdkToZvol.bind(self),
+        self.timeStage('vmdk-to-zvol', self.vmdkToZvol),
         function (wf$callback) {
             setTimeout(function () { wf$callback(); }, 5000);
         },
         self.snapshotZvol.bind(self),
-        self.zfsSendSnapshot.bind(self)
+        self.timeStage('zfs-send', self.zfsSendSnapshot)
     ],
     function (error) {
         if (error) {
@@ -84,13 +85,34 @@ DiskImage.prototype.convertToZfsStream = function (opts, callback) {
                     self.zvolName,
                     function () {
                         if (callback) {
-                            callback();
+                            callback(error, self.outputDigest);
                         }
                     });
             });
     });
 };
 
+/*
+ * Wraps a conversion stage so that it runs with the compress addon's work
+ * counters zeroed, and leaves its wall time and counters in
+ * self.stageStats[name]. Stages must not overlap.
+ */
+DiskImage.prototype.timeStage = function (name, stage) {
+    var self = this;
+
+    return function (callback) {
+        compress.resetStats();
+        var start = compress.monotonicTime();
+        stage.call(self, function (error) {
+            self.stageStats[name] = {
+                seconds: (compress.monotonicTime() - start) / 1000,
+                stats: compress.stats()
+            };
+            return callback(error);
+        });
+    };
+};
+
 DiskImage.prototype.createZvol = function (callback) {
     var self = this;
 
@@ -111,31 +133,58 @@ DiskImage.prototype.vmdkToZvol = function (callback) {
     var self = this;
     console.log('Converting zvol.');
 
-    var outputStream;
     var v = new VMDK({ filename: self.inputFile });
 
     async.waterfall([
-        function (wf$callback) {
-            outputStream = fs.createWriteStream(self.zvolDskPath);
-            return wf$callback();
-        },
         function (wf$callback) {
             v.open(function (error) {
+                if (error) {
+                    return wf$callback(error);
+                }
                 console.log('opened the file %s', self.zvolDskPath);
-                console.dir(error);
                 console.dir(v.header);
 
-                var stream = v.stream();
+                /*
+                 * The zvol was just created, so it already reads as zeroes:
+                 * unallocated grains are skipped without being decoded or
+                 * scanned, and grains that inflate to zeroes are skipped
+                 * rather than written.
+                 */
+                var outputStream = new compress.SparseWriteStream(
+                    self.zvolDskPath,
+                    { blockSize: v.header.grainSize[0] * 512 });
+                var stream = v.stream({ holes: true });
+                var failed = false;
+
+                function fail(error) {
+                    if (failed) {
+                        return;
+                    }
+                    failed = true;
+                    outputStream.destroy();
+                    wf$callback(error);
+                }
+
                 stream.pipe(outputStream);
 
                 stream.on('error', function (stream$error) {
                     console.warn(
                         'Error streaming vmdk: %s', stream$error.message);
+                    return fail(stream$error);
+                });
+
+                outputStream.on('error', function (write$error) {
+                    console.warn(
+                        'Error writing zvol: %s', write$error.message);
+                    return fail(write$error);
                 });
 
-                stream.on('end', function (data) {
+                outputStream.on('close', function () {
                     console.warn('VMDK Stream ended');
-                    outputStream.end();
+                    console.warn('Wrote %d bytes, skipped %d zero bytes',
+                        outputStream.bytesWritten, outputStream.bytesSkipped);
+                    self.bytesAllocated = outputStream.bytesWritten;
+                    self.bytesSkipped = outputStream.bytesSkipped;
                     return wf$callback();
                 });
 
@@ -144,6 +193,9 @@ DiskImage.prototype.vmdkToZvol = function (callback) {
         }
     ],
     function (error) {
+        if (v.fd !== undefined) {
+            v.close(function () {});
+        }
         if (error) {
             console.error('Error writing vmdk stream to output file');
             console.error(error.message);
@@ -165,17 +217,68 @@ DiskImage.prototype.snapshotZvol = function (callback) {
     });
 };
 
+/*
+ * The send stream is compressed in-process on all CPUs. The output is a
+ * sequence of independent bzip2 streams, which bunzip2 and image import
+ * read as one .bz2 file. Its SHA-1 and size are taken on the way through and
+ * left in self.outputDigest, so the manifest needs no second read.
+ */
 DiskImage.prototype.zfsSendSnapshot = function (callback) {
     var self = this;
     console.log('Compressing and saving ZFS stream.');
-    exec(
-        '/usr/sbin/zfs send ' + self.zvolSnapshotName
-            + ' | bzip2 > ' + self.outputFile,
-        {},
-        function (error, stdout, stderr) {
-            if (error) {
-                return callback(new Error(stderr.toString()));
+
+    var send = spawn('/usr/sbin/zfs', [ 'send', self.zvolSnapshotName ]);
+    var bzip = new compress.ParallelBzipStream(null, null, null, true);
+    var output = fs.createWriteStream(self.outputFile);
+
+    var stderr = '';
+    var exitCode = null;
+    var closed = false;
+    var finished = false;
+
+    function finish(error) {
+        if (finished) {
+            return;
+        }
+        if (!error && (exitCode === null || !closed)) {
+            return;
+        }
+        finished = true;
+        if (!error && exitCode !== 0) {
+            error = new Error(stderr);
+        }
+        if (error) {
+            /*
+             * zfs send would otherwise block on a full pipe into the dead
+             * bzip stream forever, holding the snapshot. Its exit after
+             * the kill is ignored, as finished is already set.
+             */
+            if (exitCode === null) {
+                send.stdout.destroy();
+                send.kill();
             }
-            return callback();
-        });
+            bzip.destroy();
+            output.destroy();
+        } else {
+            self.outputDigest = bzip.digest().output;
+        }
+        callback(error);
+    }
+
+    send.stderr.on('data', function (data) {
+        stderr += data.toString();
+    });
+    send.on('exit', function (code) {
+        exitCode = code;
+        finish(code === 0 ? null : new Error(stderr));
+    });
+    bzip.on('error', finish);
+    output.on('error', finish);
+    output.on('close', function () {
+        closed = true;
+        finish();
+    });
+
+    send.stdout.pipe(bzip);
+    bzip.pipe(output);
 };
@@ -0,0 +1,200 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * The digests the compressors take on the worker threads stand in for a
+ * sha1sum of the files convertvm writes, so they have to agree with it
+ * exactly, whatever the write sizes.
+ */
+
+var test = require('tap').test;
+var crypto = require('crypto');
+var spawn = require('child_process').spawn;
+var Buffer = require('buffer').Buffer;
+var compress = require('vmdk/node_modules/compress');
+
+// FIPS 180 vectors plus the empty message.
+var VECTORS = [
+    [ '', 'da39a3ee5e6b4b0d3255bfef95601890afd80709' ],
+    [ 'abc', 'a9993e364706816aba3e25717850c26c9cd0d89d' ],
+    [ 'abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq',
+        '84983e441c3bd26ebaae4aa1f95129e5e54670f1' ]
+];
+
+// One million 'a's, 15625 SHA-1 blocks.
+var MILLION_A = '34aa973cd4c4daa4f61eeb2bdbad27316534016f';
+
+// bzip2 block size of 100k, so one ParallelBzip block is 100000 bytes.
+var BZIP_BLOCK = 100000;
+
+// Write sizes around the 64-byte SHA-1 block and well beyond it.
+var SIZES = [ 1, 63, 64, 65, 127, 3, 4095, 4097, 55, 56, 65536 + 7 ];
+
+function concat(list) {
+    var length = 0;
+    list.forEach(function (b) {
+        length += b.length;
+    });
+    var buffer = new Buffer(length);
+    var offset = 0;
+    list.forEach(function (b) {
+        b.copy(buffer, offset);
+        offset += b.length;
+    });
+    return buffer;
+}
+
+function sha1(buffer) {
+    return crypto.createHash('sha1').update(buffer).digest('hex');
+}
+
+// Compressible, but not trivially so.
+function pattern(length) {
+    var buffer = new Buffer(length);
+    var x = 12345;
+    for (var i = 0; i < length; i++) {
+        x = (x * 1103515245 + 12345) & 0x7fffffff;
+        buffer[i] = 97 + (x >> 16) % 16;
+    }
+    return buffer;
+}
+
+function sha1sum(data, callback) {
+    var child = spawn('sha1sum', []);
+    var stdout = '';
+
+    child.stdout.on('data', function (data) {
+        stdout += data.toString();
+    });
+    child.on('exit', function (code) {
+        if (code !== 0) {
+            return callback(new Error('sha1sum exited ' + code));
+        }
+        return callback(null, stdout.split(' ')[0]);
+    });
+    child.stdin.end(data);
+}
+
+// Gzip `input` one write at a time, cycling through SIZES.
+function gzip(input, callback) {
+    var coder = new compress.Gzip(6, true);
+    var outputs = [];
+    var offset = 0;
+    var i = 0;
+
+    coder.enableDigest();
+
+    function writeNext() {
+        if (offset >= input.length) {
+            return coder.close(function (error, data) {
+                if (error) {
+                    return callback(error);
+                }
+                outputs.push(data);
+                return callback(null, concat(outputs), coder.digest());
+            });
+        }
+        var end = Math.min(offset + SIZES[i++ % SIZES.length], input.length);
+        var chunk = input.slice(offset, end);
+        offset = end;
+        return coder.write(chunk, function (error, data) {
+            if (error) {
+                return callback(error);
+            }
+            outputs.push(data);
+            return writeNext();
+        });
+    }
+
+    writeNext();
+}
+
+VECTORS.forEach(function (vector) {
+    test('vector "' + vector[0] + '"', function (t) {
+        var input = new Buffer(vector[0], 'binary');
+        gzip(input, function (error, output, digest) {
+            t.ifError(error, 'compressed');
+            t.equal(digest.input.bytes, input.length, 'input byte count');
+            t.equal(digest.input.sha1, vector[1], 'input SHA-1');
+            t.end();
+        });
+    });
+});
+
+test('a million a\'s in odd-sized writes', function (t) {
+    var input = new Buffer(1000000);
+    input.fill(97);
+    gzip(input, function (error, output, digest) {
+        t.ifError(error, 'compressed');
+        t.equal(digest.input.bytes, input.length, 'input byte count');
+        t.equal(digest.input.sha1, MILLION_A, 'input SHA-1');
+        t.equal(digest.output.bytes, output.length, 'output byte count');
+        t.equal(digest.output.sha1,
+            crypto.createHash('sha1').update(output).digest('hex'),
+            'output SHA-1 matches crypto');
+
+        sha1sum(output, function (sum$error, sum) {
+            t.ifError(sum$error, 'sha1sum ran');
+            t.equal(digest.output.sha1, sum, 'output SHA-1 matches sha1sum');
+            t.end();
+        });
+    });
+});
+
+function checkDigest(t, digest, input, output) {
+    t.equal(digest.input.bytes, input.length, 'input byte count');
+    t.equal(digest.input.sha1, sha1(input), 'input SHA-1');
+    t.equal(digest.output.bytes, output.length, 'output byte count');
+    t.equal(digest.output.sha1, sha1(output), 'output SHA-1');
+}
+
+// The parallel compressor hashes blocks in push order, whichever thread
+// finishes first.
+[ 0, BZIP_BLOCK, 3 * BZIP_BLOCK + 4321 ].forEach(function (length) {
+    test('ParallelBzipStream digest of ' + length + ' bytes', function (t) {
+        var input = pattern(length);
+        var bzip = new compress.ParallelBzipStream(2, 1, null, true);
+        var chunks = [];
+
+        bzip.on('data', function (data) {
+            chunks.push(data);
+        });
+        bzip.on('error', function (error) {
+            t.ifError(error, 'compressed');
+            t.end();
+        });
+        bzip.on('end', function () {
+            checkDigest(t, bzip.digest(), input, concat(chunks));
+            t.end();
+        });
+
+        for (var offset = 0; offset < input.length; offset += 7919) {
+            bzip.write(input.slice(offset,
+                Math.min(offset + 7919, input.length)));
+        }
+        bzip.end();
+    });
+});
+
+test('ParallelBzip digest with an empty block between others', function (t) {
+    var bzip = new compress.ParallelBzip(2, 1, 4, true);
+    var inputs = [ pattern(5000), new Buffer(0), pattern(BZIP_BLOCK) ];
+    var outputs = [];
+    var delivered = 0;
+
+    inputs.forEach(function (input, i) {
+        bzip.push(input, function (error, compressed) {
+            t.ifError(error, 'block ' + i + ' compressed');
+            outputs[i] = compressed;
+            if (++delivered < inputs.length) {
+                return;
+            }
+            checkDigest(t, bzip.digest(), concat(inputs), concat(outputs));
+            bzip.close();
+            t.end();
+        });
+    });
+});
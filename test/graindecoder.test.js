@@ -0,0 +1,233 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2014, Joyent, Inc.
+ */
+
+/*
+ * GrainDecoder against images from bench/genvmdk.js: tables decoded on many
+ * threads must come back in push order and hash to the generator's SHA-1,
+ * push() must report the window, and a corrupt grain must fail its own table
+ * without holding up the ones behind it.
+ */
+
+var test = require('tap').test;
+var crypto = require('crypto');
+var fs = require('fs');
+var path = require('path');
+var Buffer = require('buffer').Buffer;
+var compress = require('vmdk/node_modules/compress');
+var VMDK = require('vmdk');
+var genvmdk = require('../bench/genvmdk');
+
+var SECTOR_SIZE = 512;
+var THREADS = 8;
+var WINDOW = 2;
+
+var dir = process.env.TMPDIR || '/var/tmp';
+
+// Four grain tables of 4 KiB grains.
+var OPTIONS = { size: 8 * 1024 * 1024, grainSectors: 8, sparsity: 0.3 };
+var o = genvmdk.normalize(OPTIONS);
+var file = path.join(dir, 'graindecoder-test-' + process.pid + '.vmdk');
+var corrupt = path.join(dir, 'graindecoder-test-' + process.pid + '.bad');
+var info;
+
+function sha1(buffer) {
+    return crypto.createHash('sha1').update(buffer).digest('hex');
+}
+
+// Disk contents covered by grain table `t`.
+function expectedTable(t) {
+    var buffer = new Buffer(o.grainBytes * 512);
+    for (var i = 0; i < 512; i++) {
+        var grain = buffer.slice(i * o.grainBytes, (i + 1) * o.grainBytes);
+        if (genvmdk.isAllocated(o, t * 512 + i)) {
+            genvmdk.fillGrain(o, t * 512 + i, grain);
+        } else {
+            grain.fill(0);
+        }
+    }
+    return buffer;
+}
+
+// Grain sector offsets of every table, found through the footer's directory.
+function readTables(filename) {
+    var fd = fs.openSync(filename, 'r');
+    var size = fs.fstatSync(fd).size;
+    var footer = new Buffer(SECTOR_SIZE);
+    fs.readSync(fd, footer, 0, SECTOR_SIZE, size - SECTOR_SIZE * 2);
+
+    var gtes = footer.readUInt32LE(44);
+    var gdOffset = footer.readUInt32LE(56);
+    var directory = new Buffer(o.tables * 4);
+    fs.readSync(fd, directory, 0, directory.length, gdOffset * SECTOR_SIZE);
+
+    var tables = [];
+    for (var t = 0; t < o.tables; t++) {
+        var entries = new Buffer(gtes * 4);
+        fs.readSync(fd, entries, 0, entries.length,
+            directory.readUInt32LE(t * 4) * SECTOR_SIZE);
+        var table = [];
+        for (var i = 0; i < gtes; i++) {
+            table.push(entries.readUInt32LE(i * 4));
+        }
+        tables.push(table);
+    }
+    fs.closeSync(fd);
+    return tables;
+}
+
+test('generate an image', function (t) {
+    genvmdk.generate(file, OPTIONS, function (error, result) {
+        t.ifError(error, 'generated');
+        info = result;
+        t.end();
+    });
+});
+
+test('tables decode in order within the window', function (t) {
+    var tables = readTables(file);
+    var fd = fs.openSync(file, 'r');
+    var decoder = new compress.GrainDecoder(fd, o.grainBytes, THREADS,
+        WINDOW);
+    var hash = crypto.createHash('sha1');
+    var pushed = 0;
+    var delivered = 0;
+    var waiting = false;
+
+    function pushMore() {
+        waiting = false;
+        while (pushed < tables.length) {
+            var index = pushed++;
+            var more = decoder.push(tables[index], onTable(index));
+            t.equal(more, pushed - delivered < WINDOW,
+                'push() of table ' + index + ' reports the window');
+            t.ok(pushed - delivered <= WINDOW, 'no more than the window');
+            if (!more) {
+                waiting = true;
+                return;
+            }
+        }
+    }
+
+    function onTable(index) {
+        return function (error, buffer) {
+            t.ifError(error, 'table ' + index + ' decoded');
+            t.equal(delivered++, index, 'table ' + index + ' in order');
+            if (buffer) {
+                hash.update(buffer);
+            }
+            if (delivered === tables.length) {
+                t.equal(hash.digest('hex'), info.sha1, 'SHA-1');
+                decoder.close();
+                fs.closeSync(fd);
+                t.end();
+            } else if (waiting) {
+                pushMore();
+            }
+        };
+    }
+
+    pushMore();
+});
+
+test('an empty table between others is delivered in its place', function (t) {
+    var tables = readTables(file);
+    var fd = fs.openSync(file, 'r');
+    var decoder = new compress.GrainDecoder(fd, o.grainBytes, THREADS,
+        WINDOW);
+    var order = [];
+
+    [ tables[0], [], tables[1] ].forEach(function (table, index) {
+        decoder.push(table, function (error, buffer) {
+            t.ifError(error, 'table ' + index + ' decoded');
+            t.equal(buffer.length, table.length * o.grainBytes, 'length');
+            order.push(index);
+            if (order.length === 3) {
+                t.equal(order.join(), '0,1,2', 'push order');
+                decoder.close();
+                fs.closeSync(fd);
+                t.end();
+            }
+        });
+    });
+});
+
+test('a corrupt grain fails only its own table', function (t) {
+    var tables = readTables(file);
+    var BAD = 1;
+    var sector = 0;
+    for (var i = 0; i < tables[BAD].length && !sector; i++) {
+        sector = tables[BAD][i];
+    }
+    t.ok(sector > 0, 'table ' + BAD + ' has an allocated grain');
+
+    // Break the zlib header behind the grain marker.
+    fs.writeFileSync(corrupt, fs.readFileSync(file));
+    var fd = fs.openSync(corrupt, 'r+');
+    var junk = new Buffer([ 0xff, 0xff, 0xff, 0xff ]);
+    fs.writeSync(fd, junk, 0, junk.length, sector * SECTOR_SIZE + 12);
+
+    // Push everything at once, window or not, so later tables are already
+    // in flight when the bad one fails.
+    var decoder = new compress.GrainDecoder(fd, o.grainBytes, THREADS,
+        WINDOW);
+    var delivered = 0;
+    tables.forEach(function (table, index) {
+        decoder.push(table, function (error, buffer) {
+            t.equal(delivered++, index, 'table ' + index + ' in order');
+            if (index === BAD) {
+                t.ok(error && /Z_DATA_ERROR/.test(error.message),
+                    'table ' + index + ' reports a data error');
+            } else {
+                t.ifError(error, 'table ' + index + ' decoded');
+                t.equal(sha1(buffer), sha1(expectedTable(index)),
+                    'table ' + index + ' contents');
+            }
+            if (delivered === tables.length) {
+                decoder.close();
+                fs.closeSync(fd);
+                fs.unlinkSync(corrupt);
+                t.end();
+            }
+        });
+    });
+});
+
+test('VMDKStream with a small window matches the SHA-1', function (t) {
+    var v = new VMDK({ filename: file, decodeThreads: THREADS,
+        decodeWindow: WINDOW });
+    var hash = crypto.createHash('sha1');
+    var bytes = 0;
+
+    v.open(function (open$error) {
+        t.ifError(open$error, 'opened');
+        var stream = v.stream();
+        stream.on('data', function (data) {
+            hash.update(data);
+            bytes += data.length;
+        });
+        stream.on('error', function (error) {
+            t.ifError(error, 'streamed');
+            t.end();
+        });
+        stream.on('end', function () {
+            t.equal(bytes, info.capacity, 'whole disk');
+            t.equal(hash.digest('hex'), info.sha1, 'SHA-1');
+            v.close(function () {
+                t.end();
+            });
+        });
+        stream.start();
+    });
+});
+
+test('clean up', function (t) {
+    fs.unlinkSync(file);
+    t.end();
+});
@@ -0,0 +1,162 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2014, Joyent, Inc.
+ */
+
+/*
+ * ParallelBzip output is a sequence of independent bzip2 streams; stock
+ * bunzip2 has to read it back as a single file.
+ */
+
+var test = require('tap').test;
+var crypto = require('crypto');
+var spawn = require('child_process').spawn;
+var Buffer = require('buffer').Buffer;
+var compress = require('vmdk/node_modules/compress');
+
+// bzip2 block size of 100k, so one block is 100000 bytes of input.
+var BLOCK = 100000;
+
+function sha1(buffer) {
+    return crypto.createHash('sha1').update(buffer).digest('hex');
+}
+
+function concat(list) {
+    var length = 0;
+    list.forEach(function (b) {
+        length += b.length;
+    });
+    var buffer = new Buffer(length);
+    var offset = 0;
+    list.forEach(function (b) {
+        b.copy(buffer, offset);
+        offset += b.length;
+    });
+    return buffer;
+}
+
+// Text-like data: compressible, but not trivially so.
+function pattern(length) {
+    var buffer = new Buffer(length);
+    var x = 12345;
+    for (var i = 0; i < length; i++) {
+        x = (x * 1103515245 + 12345) & 0x7fffffff;
+        buffer[i] = 97 + (x >> 16) % 16;
+    }
+    return buffer;
+}
+
+// Number of bzip2 stream headers for block size 100k in `data`.
+function streams(data) {
+    var count = 0;
+    var text = data.toString('binary');
+    var i = text.indexOf('BZh1');
+    while (i !== -1) {
+        count++;
+        i = text.indexOf('BZh1', i + 4);
+    }
+    return count;
+}
+
+function bunzip2(data, callback) {
+    var child = spawn('bunzip2', [ '-c' ]);
+    var chunks = [];
+    var stderr = '';
+
+    child.stdout.on('data', function (data) {
+        chunks.push(data);
+    });
+    child.stderr.on('data', function (data) {
+        stderr += data.toString();
+    });
+    child.on('exit', function (code) {
+        if (code !== 0) {
+            return callback(new Error('bunzip2 exited ' + code + ': ' +
+                stderr));
+        }
+        return callback(null, concat(chunks));
+    });
+    child.stdin.end(data);
+}
+
+// Feed `input` in odd-sized writes, so blocks straddle write boundaries.
+function compressStream(input, callback) {
+    var bzip = new compress.ParallelBzipStream(2, 1);
+    var chunks = [];
+
+    bzip.on('data', function (data) {
+        chunks.push(data);
+    });
+    bzip.on('error', callback);
+    bzip.on('end', function () {
+        callback(null, concat(chunks));
+    });
+
+    for (var offset = 0; offset < input.length; offset += 7919) {
+        bzip.write(input.slice(offset, Math.min(offset + 7919, input.length)));
+    }
+    bzip.end();
+}
+
+function checkRoundTrip(t, input) {
+    compressStream(input, function (error, compressed) {
+        t.ifError(error, 'compressed');
+        t.equal(streams(compressed),
+            Math.max(1, Math.ceil(input.length / BLOCK)),
+            'one bzip2 stream per block');
+
+        bunzip2(compressed, function (bunzip$error, output) {
+            t.ifError(bunzip$error, 'bunzip2 accepts the output');
+            t.equal(output.length, input.length, 'length round-trips');
+            t.equal(sha1(output), sha1(input), 'content round-trips');
+            t.end();
+        });
+    });
+}
+
+test('empty input', function (t) {
+    checkRoundTrip(t, new Buffer(0));
+});
+
+test('input of exactly one block', function (t) {
+    checkRoundTrip(t, pattern(BLOCK));
+});
+
+test('input of several blocks and a partial one', function (t) {
+    checkRoundTrip(t, pattern(3 * BLOCK + 4321));
+});
+
+test('push() of an empty block between others', function (t) {
+    var bzip = new compress.ParallelBzip(2, 1, 4);
+    var inputs = [ pattern(5000), new Buffer(0), pattern(BLOCK) ];
+    var outputs = [];
+    var delivered = 0;
+
+    inputs.forEach(function (input, i) {
+        bzip.push(input, function (error, compressed) {
+            t.ifError(error, 'block ' + i + ' compressed');
+            t.equal(delivered++, i, 'block ' + i + ' delivered in order');
+            outputs[i] = compressed;
+            if (delivered < inputs.length) {
+                return;
+            }
+
+            var input = concat(inputs);
+            var output = concat(outputs);
+            bzip.close();
+
+            t.equal(streams(output), inputs.length,
+                'one bzip2 stream per block');
+            bunzip2(output, function (bunzip$error, data) {
+                t.ifError(bunzip$error, 'bunzip2 accepts the output');
+                t.equal(sha1(data), sha1(input), 'content round-trips');
+                t.end();
+            });
+        });
+    });
+});
@@ -0,0 +1,194 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2014, Joyent, Inc.
+ */
+
+/*
+ * Gzip and Bzip queue writes and, with coalesceWrites(), fold small ones
+ * together. Whichever way a burst of writes is processed, every callback
+ * has to fire once and in order, and the outputs concatenated have to
+ * decompress to the input with stock gunzip and bunzip2.
+ */
+
+var test = require('tap').test;
+var crypto = require('crypto');
+var spawn = require('child_process').spawn;
+var Buffer = require('buffer').Buffer;
+var compress = require('vmdk/node_modules/compress');
+
+// Enough writes, mostly well under the 16 KiB coalescing limit, to be
+// queued behind each other while the first ones are being compressed.
+var WRITES = 500;
+var SIZES = [ 1, 17, 512, 4096, 100, 16384, 16385, 3, 40000, 777 ];
+
+var CODERS = [
+    { name: 'Gzip', create: function () {
+        return new compress.Gzip(6, true);
+    }, decompress: 'gunzip' },
+    { name: 'Bzip', create: function () {
+        return new compress.Bzip(1, 0, true);
+    }, decompress: 'bunzip2' }
+];
+
+function sha1(buffer) {
+    return crypto.createHash('sha1').update(buffer).digest('hex');
+}
+
+function concat(list) {
+    var length = 0;
+    list.forEach(function (b) {
+        length += b.length;
+    });
+    var buffer = new Buffer(length);
+    var offset = 0;
+    list.forEach(function (b) {
+        b.copy(buffer, offset);
+        offset += b.length;
+    });
+    return buffer;
+}
+
+// Compressible, but not trivially so.
+function pattern(length, seed) {
+    var buffer = new Buffer(length);
+    var x = seed;
+    for (var i = 0; i < length; i++) {
+        x = (x * 1103515245 + 12345) & 0x7fffffff;
+        buffer[i] = 97 + (x >> 16) % 16;
+    }
+    return buffer;
+}
+
+function pieces() {
+    var list = [];
+    for (var i = 0; i < WRITES; i++) {
+        list.push(pattern(SIZES[i % SIZES.length], i + 1));
+    }
+    return list;
+}
+
+function decompress(command, data, callback) {
+    var child = spawn(command, [ '-c' ]);
+    var chunks = [];
+    var stderr = '';
+
+    child.stdout.on('data', function (data) {
+        chunks.push(data);
+    });
+    child.stderr.on('data', function (data) {
+        stderr += data.toString();
+    });
+    child.on('exit', function (code) {
+        if (code !== 0) {
+            return callback(new Error(command + ' exited ' + code + ': ' +
+                stderr));
+        }
+        return callback(null, concat(chunks));
+    });
+    child.stdin.end(data);
+}
+
+/*
+ * Write `inputs` back to back without waiting, then end the stream either
+ * with close() or by passing the flag to the last write(). callback(outputs)
+ * once the last callback has fired.
+ */
+function burst(t, coder, inputs, end, callback) {
+    var outputs = [];
+    var calls = [];
+    var next = 0;
+    var total = end === 'close' ? inputs.length + 1 : inputs.length;
+
+    function done(index) {
+        return function (error, data) {
+            t.ifError(error, 'request ' + index);
+            calls[index] = (calls[index] || 0) + 1;
+            if (next++ !== index) {
+                t.ok(false, 'request ' + index + ' completed out of order');
+            }
+            outputs[index] = data;
+            if (next < total) {
+                return;
+            }
+
+            var once = true;
+            for (var i = 0; i < total; i++) {
+                once = once && calls[i] === 1;
+            }
+            t.ok(once, 'every callback fired once');
+            t.equal(next, total, 'every request completed in order');
+            callback(outputs);
+        };
+    }
+
+    inputs.forEach(function (input, i) {
+        if (end === 'flush' && i === inputs.length - 1) {
+            coder.write(input, true, done(i));
+        } else {
+            coder.write(input, done(i));
+        }
+    });
+    if (end === 'close') {
+        coder.close(done(inputs.length));
+    }
+}
+
+CODERS.forEach(function (c) {
+    [ false, true ].forEach(function (coalesce) {
+        [ 'close', 'flush' ].forEach(function (end) {
+            var name = c.name + (coalesce ? ' coalesced' : ' one by one') +
+                ', ended by ' + end;
+
+            test(name, function (t) {
+                var coder = c.create();
+                var inputs = pieces();
+                if (coalesce) {
+                    coder.coalesceWrites();
+                }
+
+                burst(t, coder, inputs, end, function (outputs) {
+                    var stats = coder.stats();
+                    t.equal(stats.requests, end === 'close' ?
+                        inputs.length + 1 : inputs.length, 'requests counted');
+                    if (!coalesce) {
+                        t.equal(stats.coalesced, 0, 'nothing coalesced');
+                    }
+
+                    var input = concat(inputs);
+                    decompress(c.decompress, concat(outputs),
+                        function (error, output) {
+                            t.ifError(error, c.decompress +
+                                ' accepts the output');
+                            t.equal(output.length, input.length,
+                                'length round-trips');
+                            t.equal(sha1(output), sha1(input),
+                                'content round-trips');
+                            t.end();
+                        });
+                });
+            });
+        });
+    });
+
+    test(c.name + ' coalesceWrites() after a write throws', function (t) {
+        var coder = c.create();
+        coder.write(new Buffer('x'), function () {
+            coder.close(function () {
+                t.end();
+            });
+        });
+
+        var threw = false;
+        try {
+            coder.coalesceWrites();
+        } catch (e) {
+            threw = true;
+        }
+        t.ok(threw, 'too late to opt in');
+    });
+});
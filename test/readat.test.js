@@ -0,0 +1,277 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2014, Joyent, Inc.
+ */
+
+/*
+ * VMDK.readAt() against images from bench/genvmdk.js, whose contents can be
+ * rebuilt grain by grain: whole-disk reads must hash to the generator's
+ * SHA-1, and reads of any shape must match the grains they cover.
+ */
+
+var test = require('tap').test;
+var crypto = require('crypto');
+var fs = require('fs');
+var path = require('path');
+var Buffer = require('buffer').Buffer;
+var compress = require('vmdk/node_modules/compress');
+var VMDK = require('vmdk');
+var genvmdk = require('../bench/genvmdk');
+
+var dir = process.env.TMPDIR || '/var/tmp';
+
+// Two grain tables of 4 KiB grains, so reads cross tables as well as grains.
+var OPTIONS = { size: 4 * 1024 * 1024, grainSectors: 8, sparsity: 0.5 };
+var o = genvmdk.normalize(OPTIONS);
+var file = path.join(dir, 'readat-test-' + process.pid + '.vmdk');
+var info;
+
+function sha1(buffer) {
+    return crypto.createHash('sha1').update(buffer).digest('hex');
+}
+
+// What the disk holds at [position, position + length).
+function expected(position, length) {
+    var buffer = new Buffer(length);
+    var grain = new Buffer(o.grainBytes);
+    var done = 0;
+    while (done < length) {
+        var g = Math.floor((position + done) / o.grainBytes);
+        var within = (position + done) % o.grainBytes;
+        var n = Math.min(o.grainBytes - within, length - done);
+        if (genvmdk.isAllocated(o, g)) {
+            genvmdk.fillGrain(o, g, grain).copy(buffer, done, within,
+                within + n);
+        } else {
+            buffer.fill(0, done, done + n);
+        }
+        done += n;
+    }
+    return buffer;
+}
+
+function firstGrain(allocated) {
+    for (var g = 0; g < o.grains; g++) {
+        if (genvmdk.isAllocated(o, g) === allocated) {
+            return g;
+        }
+    }
+    return -1;
+}
+
+function same(a, b) {
+    if (a.length !== b.length) {
+        return false;
+    }
+    for (var i = 0; i < a.length; i++) {
+        if (a[i] !== b[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Run reads of [position, length] one after another on a fresh VMDK.
+function checkReads(t, options, reads) {
+    options.filename = file;
+    var v = new VMDK(options);
+    var i = 0;
+
+    function next() {
+        if (i === reads.length) {
+            return v.close(function () {
+                t.end();
+            });
+        }
+        var position = reads[i][0];
+        var length = reads[i][1];
+        i++;
+        return v.readAt(position, length, function (error, buffer) {
+            t.ifError(error, 'read ' + length + ' at ' + position);
+            if (error) {
+                return v.close(function () {
+                    t.end();
+                });
+            }
+            var want = expected(position,
+                Math.max(0, Math.min(length, o.capacity - position)));
+            t.equal(buffer.length, want.length,
+                'length of ' + length + ' at ' + position);
+            t.ok(same(buffer, want), 'contents of ' + length + ' at ' +
+                position);
+            return next();
+        });
+    }
+
+    v.open(function (error) {
+        t.ifError(error, 'opened');
+        next();
+    });
+}
+
+test('generate an image', function (t) {
+    genvmdk.generate(file, OPTIONS, function (error, result) {
+        t.ifError(error, 'generated');
+        info = result;
+        t.ok(info.allocatedGrains > 0 && info.allocatedGrains < info.grains,
+            'image has allocated and unallocated grains');
+        t.end();
+    });
+});
+
+test('whole disk matches the generator SHA-1', function (t) {
+    var v = new VMDK({ filename: file });
+    var READ = 1024 * 1024 + 4096 + 17;
+    var hash = crypto.createHash('sha1');
+    var position = 0;
+
+    function next() {
+        v.readAt(position, READ, function (error, buffer) {
+            t.ifError(error, 'read at ' + position);
+            if (error || buffer.length === 0) {
+                t.equal(position, info.capacity, 'read up to capacity');
+                t.equal(hash.digest('hex'), info.sha1, 'SHA-1');
+                return v.close(function () {
+                    t.end();
+                });
+            }
+            hash.update(buffer);
+            position += buffer.length;
+            return next();
+        });
+    }
+
+    v.open(function (error) {
+        t.ifError(error, 'opened');
+        next();
+    });
+});
+
+test('unaligned reads across grain boundaries', function (t) {
+    var g = o.grainBytes;
+    checkReads(t, {}, [
+        [ 3 * g - 100, 300 ],
+        [ 5 * g + 7, 40 * g + 13 ],
+        [ 512 * g - 1, 2 ],
+        [ 1, 3 * 512 * g ]
+    ]);
+});
+
+test('reads inside unallocated grains', function (t) {
+    var g = firstGrain(false);
+    var start = g * o.grainBytes;
+    t.ok(g >= 0, 'image has an unallocated grain');
+    checkReads(t, {}, [
+        [ start + 100, 1000 ],
+        [ start, o.grainBytes ]
+    ]);
+});
+
+test('repeated partial reads of cached grains', function (t) {
+    var g = firstGrain(true);
+    var start = g * o.grainBytes;
+    var reads = [];
+    for (var i = 0; i < 20; i++) {
+        reads.push([ start + (i * 397) % (o.grainBytes - 512), 512 ]);
+    }
+    // Straddle the grain so both neighbours go through the cache too.
+    reads.push([ start - 10, 20 ]);
+    reads.push([ start + o.grainBytes - 10, 20 ]);
+    reads.push([ start + 1, 100 ]);
+    checkReads(t, { cacheGrains: 2 }, reads);
+});
+
+test('reads ending at or past capacity come back short', function (t) {
+    checkReads(t, {}, [
+        [ o.capacity - 100, 100 ],
+        [ o.capacity - 100, 1000 ],
+        [ o.capacity - 1, o.grainBytes * 3 ],
+        [ o.capacity, 10 ],
+        [ o.capacity + o.grainBytes, 10 ]
+    ]);
+});
+
+test('native reader counts short reads', function (t) {
+    var reader = new compress.VmdkReader(file, 4);
+    reader.open(function (error, readerInfo) {
+        t.ifError(error, 'opened');
+        t.equal(readerInfo.capacity, info.capacity, 'capacity');
+        t.equal(readerInfo.allocatedGrains, info.allocatedGrains,
+            'allocated grains');
+
+        var buffer = new Buffer(1000);
+        reader.read(buffer, o.capacity - 300, function (read$error, n) {
+            t.ifError(read$error, 'read');
+            t.equal(n, 300, 'short count at the end of the disk');
+            t.ok(same(buffer.slice(0, n), expected(o.capacity - 300, 300)),
+                'contents');
+            reader.read(buffer, o.capacity, function (end$error, m) {
+                t.ifError(end$error, 'read at capacity');
+                t.equal(m, 0, 'nothing at capacity');
+                reader.close();
+                t.end();
+            });
+        });
+    });
+});
+
+test('read() after close() throws', function (t) {
+    var reader = new compress.VmdkReader(file, 4);
+    reader.open(function (error) {
+        t.ifError(error, 'opened');
+
+        var buffer = new Buffer(o.grainBytes);
+        reader.read(buffer, 0, function (read$error, n) {
+            t.ifError(read$error, 'read in flight at close() completes');
+            t.equal(n, buffer.length, 'full read');
+            t.ok(same(buffer, expected(0, buffer.length)), 'contents');
+
+            var threw = false;
+            try {
+                reader.read(buffer, 0, function () {});
+            } catch (e) {
+                threw = /not open/.test(e.message);
+            }
+            t.ok(threw, 'read() once closed');
+            t.end();
+        });
+        reader.close();
+
+        var threw = false;
+        try {
+            reader.read(new Buffer(10), 0, function () {});
+        } catch (e) {
+            threw = /not open/.test(e.message);
+        }
+        t.ok(threw, 'read() while closing');
+    });
+});
+
+test('malformed and missing files', function (t) {
+    var junk = path.join(dir, 'readat-test-' + process.pid + '.junk');
+    var buffer = new Buffer(4096);
+    buffer.fill(0x5a);
+    fs.writeFileSync(junk, buffer);
+
+    new compress.VmdkReader(junk, 4).open(function (error) {
+        t.ok(error && /Z_DATA_ERROR/.test(error.message),
+            'not an extent is a data error');
+        fs.unlinkSync(junk);
+
+        new compress.VmdkReader(junk, 4).open(function (missing$error) {
+            t.equal(missing$error && missing$error.code, 'ENOENT',
+                'a missing file is an errno error');
+            t.end();
+        });
+    });
+});
+
+test('clean up', function (t) {
+    fs.unlinkSync(file);
+    t.end();
+});
@@ -0,0 +1,203 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2014, Joyent, Inc.
+ */
+
+/*
+ * SparseWriteStream against a regular file: zero blocks must come out as
+ * holes, whether skipped on a fresh file or punched into an old one, and the
+ * file must still read back as the input. Needs a filesystem with sparse
+ * file support (ext4, xfs, zfs...) under $TMPDIR or /var/tmp.
+ */
+
+var test = require('tap').test;
+var fs = require('fs');
+var path = require('path');
+var Buffer = require('buffer').Buffer;
+var compress = require('vmdk/node_modules/compress');
+
+var BLOCK = 64 * 1024;
+var BLOCKS = 256;
+// Zero detection runs per block from the start of each write, so writes are
+// kept block-aligned for the expected counts to hold.
+var CHUNK = 8 * BLOCK;
+
+var dir = process.env.TMPDIR || '/var/tmp';
+
+function tmpfile(name) {
+    return path.join(dir, 'sparse-test-' + process.pid + '-' + name);
+}
+
+/*
+ * Every 16th block is full of data, every 16th from 8 on holds a single
+ * non-zero byte among zeros, the rest are zero. The image ends in a partial
+ * block and more than one block of zeros, which only finishing the stream
+ * can account for.
+ */
+function image() {
+    var data = new Buffer(BLOCKS * BLOCK + 1000);
+    data.fill(0);
+    for (var b = 0; b < BLOCKS - 2; b++) {
+        var start = b * BLOCK;
+        if (b % 16 === 0) {
+            for (var i = 0; i < BLOCK; i++) {
+                data[start + i] = 1 + (b + i) % 255;
+            }
+        } else if (b % 16 === 8) {
+            data[start + (b * 977) % BLOCK] = 0xff;
+        }
+    }
+    return data;
+}
+
+// Bytes of `data` in blocks holding anything but zeros.
+function allocatedBytes(data) {
+    var n = 0;
+    for (var start = 0; start < data.length; start += BLOCK) {
+        var end = Math.min(start + BLOCK, data.length);
+        for (var i = start; i < end; i++) {
+            if (data[i] !== 0) {
+                n += end - start;
+                break;
+            }
+        }
+    }
+    return n;
+}
+
+// Write `data` in CHUNK pieces, honouring 'drain'. callback(error, out).
+function writeAll(file, data, options, callback) {
+    var out = new compress.SparseWriteStream(file, options);
+    var offset = 0;
+
+    function writeSome() {
+        while (offset < data.length) {
+            var end = Math.min(offset + CHUNK, data.length);
+            var more = out.write(data.slice(offset, end));
+            offset = end;
+            if (!more) {
+                out.once('drain', writeSome);
+                return;
+            }
+        }
+        out.end();
+    }
+
+    out.on('error', callback);
+    out.on('close', function () {
+        callback(null, out);
+    });
+    writeSome();
+}
+
+function checkFile(t, file, data, out) {
+    var stats = fs.statSync(file);
+    var contents = fs.readFileSync(file);
+    var expected = allocatedBytes(data);
+
+    t.equal(out.bytesWritten, expected, 'allocated bytes reported');
+    t.equal(out.bytesSkipped, data.length - expected, 'skipped bytes reported');
+    t.equal(stats.size, data.length, 'file extended to the full length');
+    t.equal(contents.length, data.length, 'whole file read back');
+
+    var same = true;
+    for (var i = 0; i < data.length && same; i++) {
+        same = contents[i] === data[i];
+    }
+    t.ok(same, 'contents match the input');
+
+    // Filesystems round allocation up to their own block size.
+    t.ok(stats.blocks * 512 < stats.size, 'st_blocks below st_size');
+    t.ok(stats.blocks * 512 < data.length / 4, 'file is sparse');
+}
+
+test('zero blocks are skipped on a fresh file', function (t) {
+    var file = tmpfile('skip');
+    var data = image();
+
+    writeAll(file, data, { blockSize: BLOCK }, function (error, out) {
+        t.ifError(error, 'written');
+        if (!error) {
+            checkFile(t, file, data, out);
+        }
+        fs.unlinkSync(file);
+        t.end();
+    });
+});
+
+test('zero blocks are punched into an old file', function (t) {
+    var file = tmpfile('punch');
+    var data = image();
+
+    // Start from a fully allocated file so the holes have to be punched.
+    var junk = new Buffer(data.length);
+    junk.fill(0xaa);
+    fs.writeFileSync(file, junk);
+
+    writeAll(file, data, { blockSize: BLOCK, punchHoles: true, flags: 'r+' },
+        function (error, out) {
+            t.ifError(error, 'written');
+            if (!error) {
+                checkFile(t, file, data, out);
+            }
+            fs.unlinkSync(file);
+            t.end();
+        });
+});
+
+test('an all-zero tail still sets the file length', function (t) {
+    var file = tmpfile('tail');
+    var data = new Buffer(3 * BLOCK + 123);
+    data.fill(0);
+    data[5] = 1;
+
+    writeAll(file, data, { blockSize: BLOCK }, function (error, out) {
+        t.ifError(error, 'written');
+        if (!error) {
+            t.equal(fs.statSync(file).size, data.length, 'full length');
+            t.equal(out.bytesWritten, BLOCK, 'only the first block written');
+            t.equal(out.bytesSkipped, data.length - BLOCK, 'tail skipped');
+        }
+        fs.unlinkSync(file);
+        t.end();
+    });
+});
+
+test('skip() leaves known zeros unscanned', function (t) {
+    var file = tmpfile('holes');
+    var head = new Buffer(BLOCK);
+    var tail = new Buffer(1000);
+    head.fill(1);
+    tail.fill(2);
+
+    var out = new compress.SparseWriteStream(file, { blockSize: BLOCK });
+    out.on('error', function (error) {
+        t.ifError(error, 'written');
+        t.end();
+    });
+    out.on('close', function () {
+        var contents = fs.readFileSync(file);
+        var stats = fs.statSync(file);
+
+        t.equal(out.bytesWritten, head.length + tail.length, 'written');
+        t.equal(out.bytesSkipped, 2 * 16 * BLOCK, 'skipped');
+        t.equal(stats.size, head.length + tail.length + 2 * 16 * BLOCK,
+            'full length');
+        t.equal(contents[BLOCK], 0, 'hole reads as zero');
+        t.equal(contents[17 * BLOCK], 2, 'data after the hole');
+        t.ok(stats.blocks * 512 < stats.size, 'st_blocks below st_size');
+        fs.unlinkSync(file);
+        t.end();
+    });
+
+    out.write(head);
+    out.skip(16 * BLOCK);
+    out.write(tail);
+    out.skip(16 * BLOCK);
+    out.end();
+});